@@ -31,6 +31,9 @@
 #include <execinfo.h>
 #include <stdio.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <link.h>
 
 #include "malloc_hook.h"
 
@@ -52,8 +55,19 @@ static char static_buffer[256];
 static char *buffer_ptr = static_buffer;
 
 static long malloc_total = 0;
+static long malloc_peak = 0;
 static bool _in_backtrace = false;
 
+// per-thread statistics, updated only while thread scope is active.
+#define MA_TLS __thread __attribute__((tls_model("initial-exec")))
+static MA_TLS int thread_scope_depth = 0;
+static MA_TLS malloc_thread_stats_t thread_stats;
+static MA_TLS int thread_id = 0;
+
+// per-thread tag stack
+static MA_TLS int tag_stack[MALLOC_TAG_STACK_DEPTH];
+static MA_TLS int tag_depth = 0;
+
 /**
  * Memory header
  */
@@ -63,8 +77,16 @@ typedef struct strMemHeader {
     struct strMemHeader *next;
     size_t size;  // allocated memory size (excludes this header)
     void *caller[MALLOC_MAX_BACKTRACE];
+    int tid;  // allocating thread id
+    short tag;  // allocation tag
+    unsigned short flags;  // HEADER_FLAG_*
 } MemHeader;
 
+/** the allocation passed event filters (set only while filters are enabled) */
+#define HEADER_FLAG_TRACED 1
+/** the allocation is not aggregated in the call site table (table overflow) */
+#define HEADER_FLAG_SITE_OVERFLOW 2
+
 /** MAGIC number of header */
 static const long MAGIC = 0xdeadbeef;
 
@@ -74,6 +96,50 @@ static MemHeader *header_tail = NULL;
 /** dump mark: latest entry which NOT be shown */
 static MemHeader *dump_mark = NULL;
 
+/** peak snapshot */
+static long peak_threshold = -1;
+static bool has_peak_snapshot = false;
+static malloc_peak_snapshot_t peak_snapshot;
+static const char *peak_dump_filename = NULL;
+static bool peak_dump_resolve_symbols = false;
+
+/** Max number of slots to probe in hash tables of call sites */
+#define SITE_TABLE_MAX_PROBE 32
+
+/**
+ * live call site table: array of call sites and hash index (twice the capacity) to it.
+ * Updated on each alloc/free while peak snapshot is enabled.
+ * Allocated with org_malloc, not tracked.
+ */
+#define PEAK_SITE_TABLE_MIN_SIZE 1024
+#define PEAK_SITE_TABLE_MAX_SIZE (1024 * 1024)
+static malloc_site_stat_t *peak_sites = NULL;
+static size_t peak_n_sites = 0;
+static size_t peak_sites_capacity = 0;
+static int *peak_site_index = NULL;  // index of peak_sites, -1 if empty
+static long peak_overflow_size = 0;
+static long peak_overflow_count = 0;
+
+/** remote free (thread pair, allocating call site) table */
+#define REMOTE_FREE_TABLE_SIZE 1024
+static malloc_remote_free_stat_t remote_free_table[REMOTE_FREE_TABLE_SIZE];
+static long remote_free_other_size = 0;
+static long remote_free_other_count = 0;
+
+/** event filters, read without lock on the fast path */
+static bool filter_enabled = false;
+static int filter_ops = MALLOC_FILTER_ALL;
+static int filter_n_sizes = 0;
+static size_t filter_sizes[MALLOC_FILTER_MAX_ENTRIES][2];
+static int filter_n_threads = 0;
+static int filter_threads[MALLOC_FILTER_MAX_ENTRIES];
+static int filter_n_callers = 0;
+static void *filter_callers[MALLOC_FILTER_MAX_ENTRIES][2];
+
+/** per-tag statistics */
+static malloc_tag_stat_t tag_stats[MALLOC_MAX_TAGS];
+static const char *tag_names[MALLOC_MAX_TAGS];
+
 /**
  * Initializer
  */
@@ -90,11 +156,30 @@ static void ma_init() {
     }
 }
 
+/**
+ * Reset cached thread id in the child process after fork
+ */
+static void ma_atfork_child() {
+    thread_id = 0;
+}
+
+__attribute__((constructor))
+static void ma_init_atfork() {
+    pthread_atfork(NULL, NULL, ma_atfork_child);
+}
+
 /**
  * De-initializer
  */
 __attribute__((destructor))
 static void ma_exit() {
+    if (peak_dump_filename != NULL) {
+        FILE *fp = fopen(peak_dump_filename, "w");
+        if (fp) {
+            malloc_peak_dump(fp, peak_dump_resolve_symbols);
+            fclose(fp);
+        }
+    }
 }
 
 /**
@@ -130,7 +215,13 @@ void set_free_hook(free_hook_t hook) {
     pthread_mutex_unlock(&ma_mutex);
 }
 
+static void add_peak_site(MemHeader *header);
+static void remove_peak_site(MemHeader *header);
+
 void insert_header(MemHeader *header) {
+    if (peak_threshold >= 0) {
+        add_peak_site(header);
+    }
     if (header_head == NULL) {
         header->prev = header->next = NULL;
         header_head = header_tail = header;
@@ -143,6 +234,9 @@ void insert_header(MemHeader *header) {
 }
 
 void remove_header(MemHeader *header) {
+    if (peak_threshold >= 0) {
+        remove_peak_site(header);
+    }
     if (header == dump_mark) {
         dump_mark = header->prev;
     }
@@ -159,6 +253,276 @@ void remove_header(MemHeader *header) {
     }
 }
 
+static inline void count_thread_alloc(size_t size, void **callers) {
+    if (thread_scope_depth > 0 && !in_hook) { // allocations in hooks are not counted
+        thread_stats.alloc_count++;
+        thread_stats.alloc_bytes += size;
+        if (!thread_stats.has_first) {
+            thread_stats.has_first = true;
+            thread_stats.first_size = size;
+            if (callers) {
+                memcpy(thread_stats.first_caller, callers, sizeof(void*) * MALLOC_MAX_BACKTRACE);
+            } else {
+                // unknown caller (realloc of untracked block)
+                memset(thread_stats.first_caller, 0, sizeof(thread_stats.first_caller));
+            }
+        }
+    }
+}
+
+static inline void count_thread_free(size_t size) {
+    if (thread_scope_depth > 0 && !in_hook) {
+        thread_stats.free_count++;
+        thread_stats.free_bytes += size;
+    }
+}
+
+/**
+ * Get current thread id (cached)
+ */
+static inline int get_thread_id() {
+    if (thread_id == 0) {
+        thread_id = (int)syscall(SYS_gettid);
+    }
+    return thread_id;
+}
+
+static inline int current_tag() {
+    if (tag_depth == 0) {
+        return 0;
+    }
+    // ignore tags pushed over MALLOC_TAG_STACK_DEPTH
+    return tag_stack[(tag_depth <= MALLOC_TAG_STACK_DEPTH ? tag_depth : MALLOC_TAG_STACK_DEPTH) - 1];
+}
+
+static inline void count_tag_alloc(int tag, size_t size) {
+    malloc_tag_stat_t *stat = &tag_stats[tag];
+    stat->size += size;
+    stat->count++;
+    if (stat->size > stat->peak) {
+        stat->peak = stat->size;
+    }
+}
+
+static inline void count_tag_free(int tag, size_t size) {
+    tag_stats[tag].size -= size;
+    tag_stats[tag].count--;
+}
+
+static unsigned long hash_callers(void **caller) {
+    unsigned long hash = 0;
+    for (int i = 0; i < MALLOC_MAX_BACKTRACE; i++) {
+        hash = hash * 31 + ((unsigned long)caller[i] >> 4);
+    }
+    return hash;
+}
+
+static void rebuild_peak_site_index() {
+    size_t mask = peak_sites_capacity * 2 - 1;
+    memset(peak_site_index, 0xff, sizeof(int) * peak_sites_capacity * 2);
+    for (size_t i = 0; i < peak_n_sites; i++) {
+        unsigned long hash = hash_callers(peak_sites[i].caller);
+        while (peak_site_index[hash & mask] >= 0) { // linear probing
+            hash++;
+        }
+        peak_site_index[hash & mask] = (int)i;
+    }
+}
+
+/**
+ * Double the call site table, up to PEAK_SITE_TABLE_MAX_SIZE.
+ */
+static bool grow_peak_sites() {
+    size_t capacity = peak_sites_capacity > 0 ? peak_sites_capacity * 2 : PEAK_SITE_TABLE_MIN_SIZE;
+    if (capacity > PEAK_SITE_TABLE_MAX_SIZE) {
+        return false;
+    }
+    malloc_site_stat_t *sites = org_realloc(peak_sites, sizeof(malloc_site_stat_t) * capacity);
+    if (!sites) {
+        return false;
+    }
+    peak_sites = sites;
+    int *index = org_malloc(sizeof(int) * capacity * 2);
+    if (!index) {
+        return false;
+    }
+    org_free(peak_site_index);
+    peak_site_index = index;
+    peak_sites_capacity = capacity;
+    rebuild_peak_site_index();
+    return true;
+}
+
+/**
+ * Find call site in the table, and add it if not found and 'add' is true.
+ * Note: must not call malloc in this function (org_malloc is OK).
+ * @return call site, or NULL if not found or table is full
+ */
+static malloc_site_stat_t *find_peak_site(void **caller, bool add) {
+    unsigned long hash = hash_callers(caller);
+    if (peak_sites_capacity > 0) {
+        size_t mask = peak_sites_capacity * 2 - 1;
+        for (unsigned long h = hash;; h++) { // linear probing, index is at most half full
+            int i = peak_site_index[h & mask];
+            if (i < 0) break;
+            if (memcmp(peak_sites[i].caller, caller, sizeof(peak_sites[i].caller)) == 0) {
+                return &peak_sites[i];
+            }
+        }
+    }
+    if (!add || (peak_n_sites == peak_sites_capacity && !grow_peak_sites())) {
+        return NULL;
+    }
+
+    size_t mask = peak_sites_capacity * 2 - 1;
+    while (peak_site_index[hash & mask] >= 0) {
+        hash++;
+    }
+    peak_site_index[hash & mask] = (int)peak_n_sites;
+    malloc_site_stat_t *site = &peak_sites[peak_n_sites++];
+    memcpy(site->caller, caller, sizeof(site->caller));
+    site->size = 0;
+    site->count = 0;
+    return site;
+}
+
+static void add_peak_site(MemHeader *header) {
+    malloc_site_stat_t *site = find_peak_site(header->caller, true);
+    if (site) {
+        site->size += header->size;
+        site->count++;
+        header->flags &= ~HEADER_FLAG_SITE_OVERFLOW;
+    } else {
+        // table overflow: not aggregated by call site
+        peak_overflow_size += header->size;
+        peak_overflow_count++;
+        header->flags |= HEADER_FLAG_SITE_OVERFLOW;
+    }
+}
+
+static void remove_peak_site(MemHeader *header) {
+    if (header->flags & HEADER_FLAG_SITE_OVERFLOW) {
+        peak_overflow_size -= header->size;
+        peak_overflow_count--;
+        return;
+    }
+    malloc_site_stat_t *site = find_peak_site(header->caller, false);
+    if (site) {
+        site->size -= header->size;
+        site->count--;
+    }
+}
+
+/**
+ * Start updating the call site table: aggregate all live blocks.
+ */
+static void start_peak_sites() {
+    peak_n_sites = 0;
+    peak_overflow_size = 0;
+    peak_overflow_count = 0;
+    if (peak_site_index != NULL) {
+        rebuild_peak_site_index();
+    }
+    for (MemHeader *header = header_head; header; header = header->next) {
+        add_peak_site(header);
+    }
+}
+
+/**
+ * Stop updating the call site table and release it.
+ */
+static void stop_peak_sites() {
+    org_free(peak_sites);
+    org_free(peak_site_index);
+    peak_sites = NULL;
+    peak_site_index = NULL;
+    peak_n_sites = 0;
+    peak_sites_capacity = 0;
+    peak_overflow_size = 0;
+    peak_overflow_count = 0;
+}
+
+/**
+ * Capture per-call-site breakdown of the heap to the peak snapshot:
+ * copy the largest sites from the call site table.
+ */
+static void capture_peak_snapshot() {
+    memset(&peak_snapshot, 0, sizeof(peak_snapshot));
+    peak_snapshot.total = malloc_total;
+    peak_snapshot.overflow_size = peak_snapshot.other_size = peak_overflow_size;
+    peak_snapshot.overflow_count = peak_snapshot.other_count = peak_overflow_count;
+
+    // select largest sites (don't use qsort, it may call malloc)
+    for (size_t i = 0; i < peak_n_sites; i++) {
+        malloc_site_stat_t *site = &peak_sites[i];
+        if (site->count == 0) continue;
+
+        int n = peak_snapshot.n_sites;
+        if (n == MALLOC_PEAK_MAX_SITES) {
+            malloc_site_stat_t *last = &peak_snapshot.sites[n - 1];
+            if (site->size <= last->size) {
+                peak_snapshot.other_size += site->size;
+                peak_snapshot.other_count += site->count;
+                continue;
+            }
+            peak_snapshot.other_size += last->size;
+            peak_snapshot.other_count += last->count;
+            n--;
+        }
+        // insertion sort
+        int j = n;
+        while (j > 0 && peak_snapshot.sites[j - 1].size < site->size) {
+            peak_snapshot.sites[j] = peak_snapshot.sites[j - 1];
+            j--;
+        }
+        peak_snapshot.sites[j] = *site;
+        peak_snapshot.n_sites = n + 1;
+    }
+    has_peak_snapshot = true;
+}
+
+static inline void update_peak() {
+    if (malloc_total > malloc_peak) {
+        malloc_peak = malloc_total;
+        if (peak_threshold >= 0
+            && (!has_peak_snapshot || malloc_peak >= peak_snapshot.total + peak_threshold)) {
+            capture_peak_snapshot();
+        }
+    }
+}
+
+/**
+ * Record free of the block allocated by other thread.
+ * Note: must not call malloc in this function.
+ */
+static void record_remote_free(MemHeader *header, int free_tid) {
+    unsigned long hash = hash_callers(header->caller) * 31 + header->tid * 17 + free_tid;
+    for (int i = 0; i < SITE_TABLE_MAX_PROBE; i++) { // linear probing
+        malloc_remote_free_stat_t *stat = &remote_free_table[(hash + i) % REMOTE_FREE_TABLE_SIZE];
+        if (stat->count == 0) {
+            stat->alloc_tid = header->tid;
+            stat->free_tid = free_tid;
+            memcpy(stat->caller, header->caller, sizeof(stat->caller));
+        } else if (stat->alloc_tid != header->tid || stat->free_tid != free_tid
+                   || memcmp(stat->caller, header->caller, sizeof(stat->caller)) != 0) {
+            continue;
+        }
+        stat->size += header->size;
+        stat->count++;
+        return;
+    }
+    // table full (or too many collisions)
+    remote_free_other_size += header->size;
+    remote_free_other_count++;
+}
+
+static inline void check_remote_free(MemHeader *header) {
+    int tid = get_thread_id();
+    if (header->tid != tid) {
+        record_remote_free(header, tid);
+    }
+}
+
 __attribute__((noinline))
 static void** get_backtrace(void **trace) {
     const int skip = 2; // this + caller = 2
@@ -176,7 +540,49 @@ static void** get_backtrace(void **trace) {
     return trace;
 }
 
-static void *malloc_sub(size_t size, void **callers) {
+/**
+ * Check event filters. This is called before unwinding and locking.
+ * @param op  MALLOC_FILTER_MALLOC, MALLOC_FILTER_REALLOC or MALLOC_FILTER_FREE
+ * @param size  Size of the memory block
+ * @param caller  Immediate caller of the allocation
+ * @param tid  Allocating thread id, 0 for current thread
+ * @return true if the event passes the filters
+ */
+static inline bool filter_event(int op, size_t size, void *caller, int tid) {
+    if (!filter_enabled) {
+        return true;
+    }
+    if (!(filter_ops & op)) {
+        return false;
+    }
+    if (filter_n_sizes > 0) {
+        int i;
+        for (i = 0; i < filter_n_sizes; i++) {
+            if (filter_sizes[i][0] <= size && size <= filter_sizes[i][1]) break;
+        }
+        if (i == filter_n_sizes) return false;
+    }
+    if (filter_n_threads > 0) {
+        if (tid == 0) {
+            tid = get_thread_id();
+        }
+        int i;
+        for (i = 0; i < filter_n_threads; i++) {
+            if (filter_threads[i] == tid) break;
+        }
+        if (i == filter_n_threads) return false;
+    }
+    if (filter_n_callers > 0) {
+        int i;
+        for (i = 0; i < filter_n_callers; i++) {
+            if (filter_callers[i][0] <= caller && caller < filter_callers[i][1]) break;
+        }
+        if (i == filter_n_callers) return false;
+    }
+    return true;
+}
+
+static void *malloc_sub(size_t size, void **callers, bool notify) {
     void *ret;
 
     pthread_mutex_lock(&ma_mutex);
@@ -190,10 +596,16 @@ static void *malloc_sub(size_t size, void **callers) {
             header->magic = MAGIC;
             header->size = size;
             memcpy(header->caller, callers, sizeof(void*) * MALLOC_MAX_BACKTRACE);
+            header->tid = get_thread_id();
+            header->tag = current_tag();
+            header->flags = (notify && filter_enabled) ? HEADER_FLAG_TRACED : 0;
             ret = header + 1;
             insert_header(header);
+            count_thread_alloc(size, header->caller);
+            count_tag_alloc(header->tag, size);
+            update_peak();
 
-            if (malloc_hook && !in_hook) {
+            if (malloc_hook && !in_hook && notify) {
                 in_hook = true;
                 malloc_hook(ret, size, header->caller);
                 in_hook = false;
@@ -217,10 +629,17 @@ static void *malloc_sub(size_t size, void **callers) {
  */
 void *malloc(size_t size) {
     void *callers[MALLOC_MAX_BACKTRACE];
-    get_backtrace(callers);
-    //assert(callers[0] == __builtin_return_address(0));
+    bool notify = filter_event(MALLOC_FILTER_MALLOC, size, __builtin_return_address(0), 0);
+    if (notify) {
+        get_backtrace(callers);
+        //assert(callers[0] == __builtin_return_address(0));
+    } else {
+        // filtered out: record immediate caller only
+        memset(callers, 0, sizeof(callers));
+        callers[0] = __builtin_return_address(0);
+    }
 
-    return malloc_sub(size, callers);
+    return malloc_sub(size, callers, notify);
 }
 
 /**
@@ -228,10 +647,17 @@ void *malloc(size_t size) {
  */
 void *calloc(size_t n, size_t size) {
     void *callers[MALLOC_MAX_BACKTRACE];
-    get_backtrace(callers);
-    //assert(callers[0] == __builtin_return_address(0));
+    bool notify = filter_event(MALLOC_FILTER_MALLOC, n * size, __builtin_return_address(0), 0);
+    if (notify) {
+        get_backtrace(callers);
+        //assert(callers[0] == __builtin_return_address(0));
+    } else {
+        // filtered out: record immediate caller only
+        memset(callers, 0, sizeof(callers));
+        callers[0] = __builtin_return_address(0);
+    }
 
-    void *ptr = malloc_sub(n * size, callers);
+    void *ptr = malloc_sub(n * size, callers, notify);
     memset(ptr, 0, n * size);
     return ptr;
 }
@@ -255,12 +681,23 @@ void *realloc(void *oldPtr, size_t newSize) {
 	return NULL;
     }
 
+    // notify if either the old block or the new block passes the filters, to keep the trace paired
+    bool notify = filter_event(MALLOC_FILTER_REALLOC, newSize, __builtin_return_address(0), 0);
+    if (!notify && oldPtr != NULL) {
+        MemHeader *oldHeader = oldPtr - sizeof(MemHeader);
+        if (oldHeader->magic == (unsigned long)MAGIC) {
+            notify = (oldHeader->flags & HEADER_FLAG_TRACED) ? (filter_ops & MALLOC_FILTER_REALLOC) != 0
+                     : filter_event(MALLOC_FILTER_REALLOC, oldHeader->size, oldHeader->caller[0], oldHeader->tid);
+        }
+    }
+
     pthread_mutex_lock(&ma_mutex);
 
     bool hasHeader = true;
     MemHeader *header = NULL;
     size_t oldSize = 0;
     void *real_ptr = oldPtr;
+    int tag = current_tag();
 
     if (oldPtr != NULL) {
         header = oldPtr - sizeof(MemHeader);
@@ -268,6 +705,7 @@ void *realloc(void *oldPtr, size_t newSize) {
         if (hasHeader) {
             real_ptr = header;
             oldSize = header->size;
+            tag = header->tag;  // keep tag of the original block
             remove_header(header);
         }
     }
@@ -277,20 +715,46 @@ void *realloc(void *oldPtr, size_t newSize) {
         void *newRealPtr = newPtr;
         if (hasHeader) {
             header = newRealPtr;
+            if (oldPtr != NULL) {
+                // the old header was copied to the new block
+                check_remote_free(header);
+            }
             header->magic = MAGIC;
             header->size = newSize;
-            get_backtrace(header->caller);
-            //assert(header->caller[0] == __builtin_return_address(0));
+            header->tid = get_thread_id();
+            header->tag = tag;
+            header->flags = (notify && filter_enabled) ? HEADER_FLAG_TRACED : 0;
+            if (notify) {
+                get_backtrace(header->caller);
+                //assert(header->caller[0] == __builtin_return_address(0));
+            } else {
+                memset(header->caller, 0, sizeof(header->caller));
+                header->caller[0] = __builtin_return_address(0);
+            }
             newPtr = header + 1;
             insert_header(header);
         }
         malloc_total += newSize - oldSize;
+        if (oldPtr != NULL) {
+            count_thread_free(oldSize);
+        }
+        count_thread_alloc(newSize, hasHeader ? header->caller : NULL);
+        if (hasHeader) {
+            if (oldPtr != NULL) {
+                count_tag_free(tag, oldSize);
+            }
+            count_tag_alloc(tag, newSize);
+        }
+        update_peak();
 
-        if (realloc_hook && !in_hook) {
+        if (realloc_hook && !in_hook && notify) {
             in_hook = true;
             realloc_hook(oldPtr, oldSize, newPtr, newSize, hasHeader ? header->caller : NULL);
             in_hook = false;
         }
+    } else if (oldPtr != NULL && hasHeader) {
+        // the old block is left unchanged
+        insert_header(header);
     }
     pthread_mutex_unlock(&ma_mutex);
     return newPtr;
@@ -307,18 +771,30 @@ void free(void *ptr) {
         return;
     }
 
-    pthread_mutex_lock(&ma_mutex);
     void *real_ptr = ptr;
     MemHeader *header = ptr - sizeof(MemHeader);
     size_t size = 0;
+
+    // filter by the allocation of the block: notify if it was traced,
+    // or its size, allocating caller and allocating thread pass the filters
+    bool notify = true;
+    if (filter_enabled && header->magic == (unsigned long)MAGIC) {
+        notify = (header->flags & HEADER_FLAG_TRACED) ? (filter_ops & MALLOC_FILTER_FREE) != 0
+                 : filter_event(MALLOC_FILTER_FREE, header->size, header->caller[0], header->tid);
+    }
+
+    pthread_mutex_lock(&ma_mutex);
     if (checkHeader(header)) {
         real_ptr = header;
         size = header->size;
         remove_header(header);
+        check_remote_free(header);
+        count_tag_free(header->tag, size);
     }
     malloc_total -= size;
+    count_thread_free(size);
 
-    if (free_hook && !in_hook) {
+    if (free_hook && !in_hook && notify) {
         in_hook = true;
         free_hook(ptr, size, header->caller);
         in_hook = false;
@@ -331,6 +807,354 @@ long get_malloc_total() {
     return malloc_total;
 }
 
+void malloc_thread_scope_begin(malloc_thread_stats_t *saved) {
+    *saved = thread_stats;
+    thread_stats.has_first = false;
+    thread_scope_depth++;
+}
+
+void malloc_thread_scope_end(const malloc_thread_stats_t *saved) {
+    if (thread_scope_depth > 0) {
+        thread_scope_depth--;
+    }
+    if (saved->has_first) {
+        // restore first allocation of outer scope
+        thread_stats.has_first = true;
+        thread_stats.first_size = saved->first_size;
+        memcpy(thread_stats.first_caller, saved->first_caller, sizeof(thread_stats.first_caller));
+    }
+}
+
+void malloc_thread_stats(malloc_thread_stats_t *stats) {
+    *stats = thread_stats;
+}
+
+long get_malloc_peak() {
+    return malloc_peak;
+}
+
+void malloc_peak_snapshot_threshold(long threshold) {
+    pthread_mutex_lock(&ma_mutex);
+    if (threshold >= 0 && peak_threshold < 0) {
+        start_peak_sites();
+    } else if (threshold < 0 && peak_threshold >= 0) {
+        stop_peak_sites();
+    }
+    peak_threshold = threshold;
+    pthread_mutex_unlock(&ma_mutex);
+}
+
+bool malloc_peak_snapshot(malloc_peak_snapshot_t *snapshot) {
+    pthread_mutex_lock(&ma_mutex);
+    bool ret = has_peak_snapshot;
+    if (ret) {
+        *snapshot = peak_snapshot;
+    }
+    pthread_mutex_unlock(&ma_mutex);
+    return ret;
+}
+
+void malloc_peak_reset() {
+    pthread_mutex_lock(&ma_mutex);
+    malloc_peak = malloc_total;
+    has_peak_snapshot = false;
+    pthread_mutex_unlock(&ma_mutex);
+}
+
+static void malloc_peak_dump_sub(FILE *fp, const malloc_peak_snapshot_t *snapshot, bool resolve_symbol) {
+    char symbol[1024];
+    fprintf(fp, "== Start peak dump: Peak memory usage = %ld, snapshot = %ld\n", malloc_peak, snapshot->total);
+
+    for (int i = 0; i < snapshot->n_sites; i++) {
+        const malloc_site_stat_t *site = &snapshot->sites[i];
+        fprintf(fp, "%d: size=%ld count=%ld\n", i, site->size, site->count);
+        for (int j = 0; j < MALLOC_MAX_BACKTRACE; j++) {
+            void *caller = site->caller[j];
+            if (!caller) break;
+            if (resolve_symbol) {
+                get_caller_symbol(caller, symbol, sizeof(symbol));
+                fprintf(fp, "  - %s\n", symbol);
+            } else {
+                fprintf(fp, "  - %p\n", caller);
+            }
+        }
+    }
+    fprintf(fp, "others: size=%ld count=%ld\n", snapshot->other_size, snapshot->other_count);
+    if (snapshot->overflow_count > 0) {
+        fprintf(fp, "WARNING: call site table overflowed, size=%ld count=%ld are not aggregated by call site\n",
+                snapshot->overflow_size, snapshot->overflow_count);
+    }
+    fprintf(fp, "== End peak dump\n");
+}
+
+void malloc_peak_dump(FILE *fp, bool resolve_symbol) {
+    malloc_peak_snapshot_t snapshot; // copy, symbol resolution may update the snapshot
+    if (malloc_peak_snapshot(&snapshot)) {
+        malloc_peak_dump_sub(fp, &snapshot, resolve_symbol);
+    } else {
+        fprintf(fp, "== No peak snapshot: Peak memory usage = %ld\n", malloc_peak);
+    }
+}
+
+void malloc_peak_dump_at_exit(const char *filename, bool resolve_symbol) {
+    pthread_mutex_lock(&ma_mutex);
+    peak_dump_filename = filename;
+    peak_dump_resolve_symbols = resolve_symbol;
+    pthread_mutex_unlock(&ma_mutex);
+}
+
+/**
+ * Copy remote free statistics and the overflowed counts at once.
+ */
+static int copy_remote_free_stats(malloc_remote_free_stat_t *stats, int max, long *other_size, long *other_count) {
+    int n = 0;
+    pthread_mutex_lock(&ma_mutex);
+    for (int i = 0; i < REMOTE_FREE_TABLE_SIZE && n < max; i++) {
+        if (remote_free_table[i].count > 0) {
+            stats[n++] = remote_free_table[i];
+        }
+    }
+    *other_size = remote_free_other_size;
+    *other_count = remote_free_other_count;
+    pthread_mutex_unlock(&ma_mutex);
+    return n;
+}
+
+int malloc_remote_free_stats(malloc_remote_free_stat_t *stats, int max) {
+    long other_size, other_count;
+    return copy_remote_free_stats(stats, max, &other_size, &other_count);
+}
+
+void malloc_remote_free_reset() {
+    pthread_mutex_lock(&ma_mutex);
+    memset(remote_free_table, 0, sizeof(remote_free_table));
+    remote_free_other_size = 0;
+    remote_free_other_count = 0;
+    pthread_mutex_unlock(&ma_mutex);
+}
+
+static int compare_remote_free_stat(const void *a, const void *b) {
+    const malloc_remote_free_stat_t *sa = a, *sb = b;
+    if (sa->alloc_tid != sb->alloc_tid) return sa->alloc_tid < sb->alloc_tid ? -1 : 1;
+    if (sa->free_tid != sb->free_tid) return sa->free_tid < sb->free_tid ? -1 : 1;
+    if (sa->size != sb->size) return sa->size > sb->size ? -1 : 1;  // larger first
+    return 0;
+}
+
+void malloc_remote_free_dump(FILE *fp, bool resolve_symbol) {
+    char symbol[1024];
+    malloc_remote_free_stat_t *stats = malloc(sizeof(remote_free_table));
+    if (!stats) return;
+    long other_size, other_count;
+    int n = copy_remote_free_stats(stats, REMOTE_FREE_TABLE_SIZE, &other_size, &other_count);
+    qsort(stats, n, sizeof(*stats), compare_remote_free_stat);
+
+    long total_size = 0, total_count = 0;
+    fprintf(fp, "== Start remote free dump\n");
+    for (int i = 0; i < n;) {
+        // thread pair
+        long pair_size = 0, pair_count = 0;
+        int end = i;
+        while (end < n && stats[end].alloc_tid == stats[i].alloc_tid && stats[end].free_tid == stats[i].free_tid) {
+            pair_size += stats[end].size;
+            pair_count += stats[end].count;
+            end++;
+        }
+        fprintf(fp, "thread %d -> %d: size=%ld count=%ld\n", stats[i].alloc_tid, stats[i].free_tid, pair_size, pair_count);
+        total_size += pair_size;
+        total_count += pair_count;
+
+        // allocating call sites
+        for (; i < end; i++) {
+            fprintf(fp, "  size=%ld count=%ld\n", stats[i].size, stats[i].count);
+            for (int j = 0; j < MALLOC_MAX_BACKTRACE; j++) {
+                void *caller = stats[i].caller[j];
+                if (!caller) break;
+                if (resolve_symbol) {
+                    get_caller_symbol(caller, symbol, sizeof(symbol));
+                    fprintf(fp, "    - %s\n", symbol);
+                } else {
+                    fprintf(fp, "    - %p\n", caller);
+                }
+            }
+        }
+    }
+    if (other_count > 0) {
+        fprintf(fp, "others: size=%ld count=%ld\n", other_size, other_count);
+        total_size += other_size;
+        total_count += other_count;
+    }
+    fprintf(fp, "== End remote free dump: Total remote free size=%ld count=%ld\n", total_size, total_count);
+    free(stats);
+}
+
+void malloc_hook_push_tag(int tag) {
+    if (tag < 0 || tag >= MALLOC_MAX_TAGS) {
+        tag = 0;
+    }
+    if (tag_depth < MALLOC_TAG_STACK_DEPTH) {
+        tag_stack[tag_depth] = tag;
+    }
+    tag_depth++;
+}
+
+void malloc_hook_pop_tag() {
+    if (tag_depth > 0) {
+        tag_depth--;
+    }
+}
+
+int malloc_hook_current_tag() {
+    return current_tag();
+}
+
+int malloc_hook_get_tag(void *ptr) {
+    if (!ptr || (static_buffer <= (char*)ptr && (char *)ptr < static_buffer + sizeof(static_buffer))) {
+        return 0;
+    }
+    MemHeader *header = ptr - sizeof(MemHeader);
+    return header->magic == (unsigned long)MAGIC ? header->tag : 0;
+}
+
+void malloc_hook_set_tag_name(int tag, const char *name) {
+    if (tag < 0 || tag >= MALLOC_MAX_TAGS) return;
+    pthread_mutex_lock(&ma_mutex);
+    tag_names[tag] = name;
+    pthread_mutex_unlock(&ma_mutex);
+}
+
+void malloc_tag_stats(int tag, malloc_tag_stat_t *stat) {
+    if (tag < 0 || tag >= MALLOC_MAX_TAGS) {
+        memset(stat, 0, sizeof(*stat));
+        return;
+    }
+    pthread_mutex_lock(&ma_mutex);
+    *stat = tag_stats[tag];
+    pthread_mutex_unlock(&ma_mutex);
+}
+
+void malloc_tag_dump(FILE *fp) {
+    malloc_tag_stat_t stats[MALLOC_MAX_TAGS];
+    const char *names[MALLOC_MAX_TAGS];
+    pthread_mutex_lock(&ma_mutex);
+    memcpy(stats, tag_stats, sizeof(stats));
+    memcpy(names, tag_names, sizeof(names));
+    pthread_mutex_unlock(&ma_mutex);
+
+    fprintf(fp, "== Start tag dump\n");
+    for (int i = 0; i < MALLOC_MAX_TAGS; i++) {
+        if (stats[i].peak == 0 && stats[i].count == 0) continue;
+        fprintf(fp, "%d (%s): size=%ld count=%ld peak=%ld\n",
+                i, names[i] ? names[i] : "-", stats[i].size, stats[i].count, stats[i].peak);
+    }
+    fprintf(fp, "== End tag dump\n");
+}
+
+static void update_filter_enabled() {
+    filter_enabled = filter_ops != MALLOC_FILTER_ALL
+                     || filter_n_sizes > 0 || filter_n_threads > 0 || filter_n_callers > 0;
+}
+
+void malloc_hook_filter_reset() {
+    pthread_mutex_lock(&ma_mutex);
+    filter_enabled = false;
+    filter_ops = MALLOC_FILTER_ALL;
+    filter_n_sizes = 0;
+    filter_n_threads = 0;
+    filter_n_callers = 0;
+    pthread_mutex_unlock(&ma_mutex);
+}
+
+void malloc_hook_filter_ops(int ops) {
+    pthread_mutex_lock(&ma_mutex);
+    filter_ops = ops & MALLOC_FILTER_ALL;
+    update_filter_enabled();
+    pthread_mutex_unlock(&ma_mutex);
+}
+
+int malloc_hook_filter_add_size(size_t min, size_t max) {
+    int ret = -1;
+    pthread_mutex_lock(&ma_mutex);
+    if (filter_n_sizes < MALLOC_FILTER_MAX_ENTRIES) {
+        filter_sizes[filter_n_sizes][0] = min;
+        filter_sizes[filter_n_sizes][1] = max;
+        filter_n_sizes++;
+        update_filter_enabled();
+        ret = 0;
+    }
+    pthread_mutex_unlock(&ma_mutex);
+    return ret;
+}
+
+int malloc_hook_filter_add_thread(int tid) {
+    int ret = -1;
+    pthread_mutex_lock(&ma_mutex);
+    if (filter_n_threads < MALLOC_FILTER_MAX_ENTRIES) {
+        filter_threads[filter_n_threads++] = tid;
+        update_filter_enabled();
+        ret = 0;
+    }
+    pthread_mutex_unlock(&ma_mutex);
+    return ret;
+}
+
+int malloc_hook_filter_add_caller(void *start, void *end) {
+    int ret = -1;
+    pthread_mutex_lock(&ma_mutex);
+    if (filter_n_callers < MALLOC_FILTER_MAX_ENTRIES) {
+        filter_callers[filter_n_callers][0] = start;
+        filter_callers[filter_n_callers][1] = end;
+        filter_n_callers++;
+        update_filter_enabled();
+        ret = 0;
+    }
+    pthread_mutex_unlock(&ma_mutex);
+    return ret;
+}
+
+struct filter_module_arg {
+    const char *name;
+    int n_ranges;
+    char *ranges[MALLOC_FILTER_MAX_ENTRIES][2];
+};
+
+/**
+ * Collect code ranges of the module.
+ * Note: don't take ma_mutex here, dl_iterate_phdr holds the loader lock.
+ */
+static int add_module_callback(struct dl_phdr_info *info, size_t size, void *data) {
+    (void)size;
+    struct filter_module_arg *arg = data;
+    if (arg->name == NULL ? info->dlpi_name[0] != '\0' : strstr(info->dlpi_name, arg->name) == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < info->dlpi_phnum && arg->n_ranges < MALLOC_FILTER_MAX_ENTRIES; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X)) {
+            char *start = (char *)(info->dlpi_addr + phdr->p_vaddr);
+            arg->ranges[arg->n_ranges][0] = start;
+            arg->ranges[arg->n_ranges][1] = start + phdr->p_memsz;
+            arg->n_ranges++;
+        }
+    }
+    return 0;
+}
+
+int malloc_hook_filter_add_module(const char *name) {
+    struct filter_module_arg arg;
+    arg.name = name;
+    arg.n_ranges = 0;
+    dl_iterate_phdr(add_module_callback, &arg);
+
+    int found = 0;
+    for (int i = 0; i < arg.n_ranges; i++) {
+        if (malloc_hook_filter_add_caller(arg.ranges[i][0], arg.ranges[i][1]) == 0) {
+            found++;
+        }
+    }
+    return found > 0 ? 0 : -1;
+}
+
 void malloc_heap_dump_mark() {
     pthread_mutex_lock(&ma_mutex);
     dump_mark = header_tail;
@@ -344,6 +1168,10 @@ void malloc_heap_dump_unmark() {
 }
 
 void malloc_heap_dump(FILE *fp, bool resolve_symbol) {
+    malloc_heap_dump_tag(fp, resolve_symbol, -1);
+}
+
+void malloc_heap_dump_tag(FILE *fp, bool resolve_symbol, int tag) {
     char symbol[1024];
     size_t total = 0;
     pthread_mutex_lock(&ma_mutex);
@@ -359,9 +1187,12 @@ void malloc_heap_dump(FILE *fp, bool resolve_symbol) {
             fprintf(fp, "WARNING: bad header magic [%p], abort dump.", header + 1);
             break;
         }
+        if (tag >= 0 && header->tag != tag) {
+            continue;
+        }
         total += header->size;
 
-        fprintf(fp, "%d: [%p] size=%ld\n", i, header + 1, header->size);
+        fprintf(fp, "%d: [%p] size=%ld tid=%d tag=%d\n", i, header + 1, header->size, header->tid, header->tag);
         in_hook = true; // don't call hook in this function
         for (int j = 0; j < MALLOC_MAX_BACKTRACE; j++) {
             void *caller = header->caller[j];
@@ -60,6 +60,274 @@ void set_free_hook(free_hook_t hook);
  */
 long get_malloc_total();
 
+/**
+ * Per-thread allocation statistics.
+ * Counters are updated only while a thread scope is active (see malloc_thread_scope_begin()).
+ */
+typedef struct {
+    long alloc_count;   // number of malloc/calloc/realloc calls
+    long alloc_bytes;   // total bytes requested by them
+    long free_count;    // number of free/realloc calls releasing a block
+    long free_bytes;    // total bytes released by them
+    bool has_first;     // true if first_* below are valid
+    size_t first_size;  // size of the first allocation in the innermost scope
+    void *first_caller[MALLOC_MAX_BACKTRACE];  // caller stack of the first allocation in the innermost scope
+} malloc_thread_stats_t;
+
+/**
+ * Begin per-thread allocation counting.
+ * Scopes can be nested. The first allocation record is cleared, and the previous one
+ * is saved to 'saved' to be restored by malloc_thread_scope_end().
+ *
+ * @param saved  Saved statistics, must be passed to malloc_thread_scope_end()
+ */
+void malloc_thread_scope_begin(malloc_thread_stats_t *saved);
+
+/**
+ * End per-thread allocation counting.
+ * @param saved  Statistics saved by malloc_thread_scope_begin()
+ */
+void malloc_thread_scope_end(const malloc_thread_stats_t *saved);
+
+/**
+ * Get per-thread allocation statistics of current thread.
+ * @param stats  Output statistics
+ */
+void malloc_thread_stats(malloc_thread_stats_t *stats);
+
+/**
+ * Get peak of total malloced size
+ * @return size
+ */
+long get_malloc_peak();
+
+// Max number of call sites recorded in the peak snapshot.
+#define MALLOC_PEAK_MAX_SITES 32
+
+/**
+ * Live heap usage of a call site.
+ */
+typedef struct {
+    void *caller[MALLOC_MAX_BACKTRACE];
+    long size;   // live bytes
+    long count;  // live blocks
+} malloc_site_stat_t;
+
+/**
+ * Per-call-site breakdown of the heap at peak.
+ */
+typedef struct {
+    long total;        // total malloced size when captured
+    int n_sites;       // number of valid entries of sites
+    long other_size;   // live bytes of call sites not in sites
+    long other_count;  // live blocks of call sites not in sites
+    long overflow_size;   // live bytes not aggregated by call site because of too many call sites (included in other_size)
+    long overflow_count;  // live blocks not aggregated by call site (included in other_count)
+    malloc_site_stat_t sites[MALLOC_PEAK_MAX_SITES];  // sorted by size, largest first
+} malloc_peak_snapshot_t;
+
+/**
+ * Set peak snapshot threshold.
+ * When the total malloced size reaches a new peak which exceeds the last snapshot by
+ * the threshold, per-call-site breakdown of the heap is captured.
+ *
+ * While enabled, live blocks are aggregated by call site on each alloc/free, and
+ * capturing copies the largest call sites.
+ *
+ * @param threshold Threshold in bytes. Negative value disables the snapshot (default).
+ */
+void malloc_peak_snapshot_threshold(long threshold);
+
+/**
+ * Get the last peak snapshot.
+ * @param snapshot Output snapshot
+ * @return true if a snapshot has been captured
+ */
+bool malloc_peak_snapshot(malloc_peak_snapshot_t *snapshot);
+
+/**
+ * Reset the peak and the peak snapshot to current total malloced size.
+ */
+void malloc_peak_reset();
+
+/**
+ * Dump the last peak snapshot.
+ *
+ * @param fp   Output stream of dump (stderr, etc)
+ * @param resolve_symbols   Set true to resolve symbols.
+ */
+void malloc_peak_dump(FILE *fp, bool resolve_symbols);
+
+/**
+ * Dump the last peak snapshot to the file at exit.
+ *
+ * @param filename  Output file name, NULL to cancel. The string must be valid until exit.
+ * @param resolve_symbols   Set true to resolve symbols.
+ */
+void malloc_peak_dump_at_exit(const char *filename, bool resolve_symbols);
+
+/**
+ * Remote free statistics: blocks allocated on a thread and freed (or realloced) on another thread.
+ */
+typedef struct {
+    int alloc_tid;  // allocating thread id
+    int free_tid;   // freeing thread id
+    void *caller[MALLOC_MAX_BACKTRACE];  // allocating call site
+    long size;      // freed bytes
+    long count;     // freed blocks
+} malloc_remote_free_stat_t;
+
+/**
+ * Get remote free statistics per (allocating thread, freeing thread, allocating call site).
+ *
+ * @param stats  Output statistics
+ * @param max    Max number of entries of stats
+ * @return Number of entries stored
+ */
+int malloc_remote_free_stats(malloc_remote_free_stat_t *stats, int max);
+
+/**
+ * Reset remote free statistics.
+ */
+void malloc_remote_free_reset();
+
+/**
+ * Dump remote free statistics as thread pair matrix, broken down by allocating call site.
+ *
+ * @param fp   Output stream of dump (stderr, etc)
+ * @param resolve_symbols   Set true to resolve symbols.
+ */
+void malloc_remote_free_dump(FILE *fp, bool resolve_symbols);
+
+// Max number of allocation tags. Tag 0 means untagged.
+#define MALLOC_MAX_TAGS 64
+
+// Max depth of the tag stack of each thread.
+#define MALLOC_TAG_STACK_DEPTH 16
+
+/**
+ * Push allocation tag to the tag stack of current thread.
+ * Memory blocks allocated on this thread are stamped with the tag on top of the stack.
+ * Realloced blocks keep the tag of the original block.
+ *
+ * @param tag  Tag, 1 to MALLOC_MAX_TAGS - 1. Out of range value is treated as 0 (untagged).
+ */
+void malloc_hook_push_tag(int tag);
+
+/**
+ * Pop allocation tag from the tag stack of current thread.
+ */
+void malloc_hook_pop_tag();
+
+/**
+ * Get current allocation tag of current thread.
+ * @return tag
+ */
+int malloc_hook_current_tag();
+
+/**
+ * Get allocation tag of the memory block.
+ * @param ptr  Memory block
+ * @return tag
+ */
+int malloc_hook_get_tag(void *ptr);
+
+/**
+ * Set name of the tag, used by malloc_tag_dump().
+ * @param tag  Tag
+ * @param name Name of the tag. The string must be valid while used.
+ */
+void malloc_hook_set_tag_name(int tag, const char *name);
+
+/**
+ * Per-tag statistics.
+ */
+typedef struct {
+    long size;   // live bytes
+    long count;  // live blocks
+    long peak;   // peak of live bytes
+} malloc_tag_stat_t;
+
+/**
+ * Get per-tag statistics.
+ * @param tag  Tag
+ * @param stat Output statistics
+ */
+void malloc_tag_stats(int tag, malloc_tag_stat_t *stat);
+
+/**
+ * Dump per-tag statistics.
+ * @param fp   Output stream of dump (stderr, etc)
+ */
+void malloc_tag_dump(FILE *fp);
+
+// Operation types of event filter
+#define MALLOC_FILTER_MALLOC  1  // malloc, calloc
+#define MALLOC_FILTER_REALLOC 2
+#define MALLOC_FILTER_FREE    4
+#define MALLOC_FILTER_ALL     7
+
+// Max number of entries of each event filter.
+#define MALLOC_FILTER_MAX_ENTRIES 16
+
+/*
+ * Event filters
+ *
+ * Filters are evaluated before unwinding the caller stack and locking.
+ * Filtered out events are tracked without unwinding (only the immediate caller is recorded),
+ * and hooks are not called for them.
+ *
+ * An event passes if it matches all kind of filters: operation types, size ranges, threads
+ * and caller ranges. A kind of filter without any entry matches all events.
+ * Free events of traced blocks always pass (unless MALLOC_FILTER_FREE is off), others are
+ * filtered with the size, the immediate caller and the thread of the allocation.
+ * Realloc events pass if either the old block or the new block passes the filters,
+ * so that traced blocks stay paired.
+ *
+ * Set filters before setting hooks or starting memory trace.
+ */
+
+/**
+ * Reset all event filters.
+ */
+void malloc_hook_filter_reset();
+
+/**
+ * Set operation types filter.
+ * @param ops  OR of MALLOC_FILTER_MALLOC, MALLOC_FILTER_REALLOC and MALLOC_FILTER_FREE
+ */
+void malloc_hook_filter_ops(int ops);
+
+/**
+ * Add size range filter.
+ * @param min  Min size (inclusive)
+ * @param max  Max size (inclusive)
+ * @return 0 on success, -1 if too many entries
+ */
+int malloc_hook_filter_add_size(size_t min, size_t max);
+
+/**
+ * Add thread filter.
+ * @param tid  Thread id (gettid)
+ * @return 0 on success, -1 if too many entries
+ */
+int malloc_hook_filter_add_thread(int tid);
+
+/**
+ * Add immediate caller address range filter.
+ * @param start  Start address (inclusive)
+ * @param end    End address (exclusive)
+ * @return 0 on success, -1 if too many entries
+ */
+int malloc_hook_filter_add_caller(void *start, void *end);
+
+/**
+ * Add immediate caller filter with the code of the module (executable or shared library).
+ * @param name  Part of the module path name (ex. "libfoo.so"), NULL for the main program
+ * @return 0 on success, -1 if no module found or too many entries
+ */
+int malloc_hook_filter_add_module(const char *name);
+
 /**
  * Heap dump all heap.
  * If heap dump mark is set, only newer entry than the mark will be displayed.
@@ -71,6 +339,16 @@ long get_malloc_total();
  */
 void malloc_heap_dump(FILE *fp, bool resolve_symbols);
 
+/**
+ * Heap dump of the memory blocks with the tag.
+ * If heap dump mark is set, only newer entry than the mark will be displayed.
+ *
+ * @param fp   Output stream of dump (stderr, etc)
+ * @param resolve_symbols   Set true to resolve symbols.
+ * @param tag  Tag, -1 for all blocks.
+ */
+void malloc_heap_dump_tag(FILE *fp, bool resolve_symbols, int tag);
+
 /**
  * Mark heap dump point.
  * If the mark is set, only newer entry than the mark will be displayed by malloc_heap_dump().
@@ -115,6 +393,24 @@ void malloc_hook_mtrace(const char *argv0, const char *filename, int resolve_sym
  */
 void malloc_hook_mtrace_fp(const char *argv0, FILE *fp, int resolve_symbol, int max_stack_depth);
 
+/**
+ * Enable/disable thread id output of memory trace.
+ * If enabled, " t=<tid>" is appended to each trace line. This is used by mtrace_replay
+ * to replay per-thread allocation streams.
+ * Call this before malloc_hook_mtrace().
+ *
+ * @param enable Set true to output thread id
+ */
+void malloc_hook_mtrace_thread_id(int enable);
+
+/**
+ * Set tag filter of memory trace.
+ * If set, only operations of the memory blocks with the tag are traced.
+ *
+ * @param tag Tag, -1 to trace all (default)
+ */
+void malloc_hook_mtrace_tag(int tag);
+
 /**
  * stop memory trace
  */
@@ -0,0 +1,164 @@
+/*
+ * Memory Hook library for debugging
+ * https://github.com/tmurakam/malloc_hook
+ *
+ * Copyright (c) 2022, Takuya Murakami.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, 
+ *      this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+#include "malloc_hook.h"
+
+namespace malloc_hook {
+
+/**
+ * Count allocations of current thread while this object is alive.
+ * Only the allocations on the thread which created this object are counted.
+ */
+class ScopedAllocCounter {
+public:
+    ScopedAllocCounter() {
+        malloc_thread_scope_begin(&saved_);
+        start_ = saved_;
+        active_ = true;
+    }
+
+    ~ScopedAllocCounter() {
+        stop();
+    }
+
+    ScopedAllocCounter(const ScopedAllocCounter &) = delete;
+    ScopedAllocCounter &operator=(const ScopedAllocCounter &) = delete;
+
+    /**
+     * Stop counting. Counters are frozen after this call.
+     */
+    void stop() {
+        if (active_) {
+            malloc_thread_stats(&end_);
+            malloc_thread_scope_end(&saved_);
+            active_ = false;
+        }
+    }
+
+    long allocCount() const { return current().alloc_count - start_.alloc_count; }
+    long allocBytes() const { return current().alloc_bytes - start_.alloc_bytes; }
+    long freeCount() const { return current().free_count - start_.free_count; }
+    long freeBytes() const { return current().free_bytes - start_.free_bytes; }
+
+    /**
+     * Report counters and caller stack of the first allocation in this scope.
+     * Note: This function allocates memory, call stop() before this to exclude it from counters.
+     *
+     * @param resolve_symbols Set true to resolve symbols.
+     */
+    std::string report(bool resolve_symbols = true) const {
+        malloc_thread_stats_t stats = current();
+        char symbol[1024];
+        char buf[sizeof(symbol) + 16];
+        std::string s;
+
+        snprintf(buf, sizeof(buf), "alloc: count=%ld, bytes=%ld / free: count=%ld, bytes=%ld\n",
+                 stats.alloc_count - start_.alloc_count, stats.alloc_bytes - start_.alloc_bytes,
+                 stats.free_count - start_.free_count, stats.free_bytes - start_.free_bytes);
+        s += buf;
+
+        if (stats.alloc_count > start_.alloc_count && stats.has_first) {
+            snprintf(buf, sizeof(buf), "first allocation: size=%zu\n", stats.first_size);
+            s += buf;
+            for (int i = 0; i < MALLOC_MAX_BACKTRACE; i++) {
+                void *caller = stats.first_caller[i];
+                if (!caller) break;
+                if (resolve_symbols) {
+                    get_caller_symbol(caller, symbol, sizeof(symbol));
+                    snprintf(buf, sizeof(buf), "  - %s\n", symbol);
+                } else {
+                    snprintf(buf, sizeof(buf), "  - %p\n", caller);
+                }
+                s += buf;
+            }
+        }
+        return s;
+    }
+
+private:
+    malloc_thread_stats_t current() const {
+        if (!active_) {
+            return end_;
+        }
+        malloc_thread_stats_t stats;
+        malloc_thread_stats(&stats);
+        return stats;
+    }
+
+    malloc_thread_stats_t saved_;
+    malloc_thread_stats_t start_;
+    malloc_thread_stats_t end_;
+    bool active_;
+};
+
+/**
+ * Assert no allocation occurs on current thread while this object is alive.
+ */
+class ScopedNoAlloc : public ScopedAllocCounter {
+public:
+    /**
+     * @return true if no allocation occurred
+     */
+    bool ok() const {
+        return allocCount() == 0;
+    }
+};
+
+/**
+ * Push allocation tag while this object is alive.
+ */
+class ScopedTag {
+public:
+    explicit ScopedTag(int tag) {
+        malloc_hook_push_tag(tag);
+    }
+
+    ~ScopedTag() {
+        malloc_hook_pop_tag();
+    }
+
+    ScopedTag(const ScopedTag &) = delete;
+    ScopedTag &operator=(const ScopedTag &) = delete;
+};
+
+} // namespace malloc_hook
+
+/**
+ * gtest assertions: check that the statement does not allocate memory on current thread.
+ */
+#define MALLOC_HOOK_NO_ALLOC_(statement, assertion) \
+    do { \
+        ::malloc_hook::ScopedNoAlloc _no_alloc_scope; \
+        statement; \
+        _no_alloc_scope.stop(); \
+        assertion(_no_alloc_scope.ok()) << _no_alloc_scope.report(); \
+    } while (0)
+
+#define ASSERT_NO_ALLOC(statement) MALLOC_HOOK_NO_ALLOC_(statement, ASSERT_TRUE)
+#define EXPECT_NO_ALLOC(statement) MALLOC_HOOK_NO_ALLOC_(statement, EXPECT_TRUE)
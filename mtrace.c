@@ -22,8 +22,11 @@
  * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
 #include "malloc_hook.h"
 
@@ -33,6 +36,8 @@ static bool _resolve_symbol;
 static int _max_stack_depth;
 static bool _started = false;
 static bool _need_close = false;
+static bool _thread_id = false;
+static int _tag = -1;
 
 static void mtrace_start(const char *argv0, bool resolve_symbol, int max_stack_depth) {
     if (!_started) {
@@ -62,6 +67,9 @@ static void mtrace_stop() {
 
 static void print_caller_symbol(void *caller[]) {
     char caller_symbol[1024];
+    if (_thread_id) {
+        fprintf(_fp, " t=%ld", (long)syscall(SYS_gettid));
+    }
     if (_resolve_symbol) {
         fprintf(_fp, " (");
         for (int i = 0; i < _max_stack_depth && i < MALLOC_MAX_BACKTRACE; i++) {
@@ -79,11 +87,13 @@ static void print_caller_symbol(void *caller[]) {
 }
 
 static void mtrace_malloc_hook(void *ptr, size_t size, void *caller[]) {
+    if (_tag >= 0 && malloc_hook_get_tag(ptr) != _tag) return;
     fprintf(_fp, "@ %s:[%p] + %p 0x%zx", _program_name, caller[0], ptr, size);
     print_caller_symbol(caller);
 }
 
 static void mtrace_realloc_hook(void *oldPtr, size_t oldSize, void *newPtr, size_t newSize, void *caller[]) {
+    if (_tag >= 0 && malloc_hook_get_tag(newPtr) != _tag) return;
     fprintf(_fp, "@ %s:[%p] < %p", _program_name, caller[0], oldPtr);
     print_caller_symbol(caller);
     fprintf(_fp, "@ %s:[%p] > %p 0x%zx", _program_name, caller[0], newPtr, newSize);
@@ -91,6 +101,7 @@ static void mtrace_realloc_hook(void *oldPtr, size_t oldSize, void *newPtr, size
 }
 
 static void mtrace_free_hook(void *ptr, size_t size, void *caller[]) {
+    if (_tag >= 0 && malloc_hook_get_tag(ptr) != _tag) return;
     fprintf(_fp, "@ %s:[%p] - %p", _program_name, caller[0], ptr);
     print_caller_symbol(caller);
 }
@@ -109,6 +120,14 @@ void malloc_hook_mtrace(const char *argv0, const char *filename, int resolve_sym
     malloc_hook_mtrace_fp(argv0, fp, resolve_symbol, max_stack_depth);
 }
 
+void malloc_hook_mtrace_thread_id(int enable) {
+    _thread_id = enable;
+}
+
+void malloc_hook_mtrace_tag(int tag) {
+    _tag = tag;
+}
+
 void malloc_hook_muntrace() {
     set_malloc_hook(NULL);
     set_realloc_hook(NULL);
@@ -1,5 +1,8 @@
 #include <gtest/gtest.h>
 #include <dlfcn.h>
+#include <thread>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include "../malloc_hook.h"
 
@@ -119,4 +122,132 @@ TEST(MallocHookTest, heap_dump) {
 
 TEST(MallocHookTest, dump_backtrace) {
     dump_backtrace(16);
-}
\ No newline at end of file
+}
+
+TEST(MallocHookTest, peak_snapshot) {
+    _hookSetUp.clear();
+    malloc_peak_reset();
+    malloc_peak_snapshot_threshold(100000);
+
+    long initial = get_malloc_total();
+    void *p1 = malloc(200000);
+    void *p2 = malloc(300000);
+    ASSERT_EQ(get_malloc_peak(), initial + 500000);
+    free(p2);
+    free(p1);
+    ASSERT_EQ(get_malloc_peak(), initial + 500000);
+
+    malloc_peak_snapshot_t snapshot;
+    ASSERT_TRUE(malloc_peak_snapshot(&snapshot));
+    ASSERT_EQ(snapshot.total, initial + 500000);
+    ASSERT_GE(snapshot.n_sites, 1);
+    // both blocks are in the snapshot
+    long size = 0;
+    for (int i = 0; i < snapshot.n_sites; i++) {
+        if (snapshot.sites[i].size >= 200000) size += snapshot.sites[i].size;
+    }
+    ASSERT_EQ(size, 500000);
+    ASSERT_EQ(snapshot.overflow_count, 0);
+
+    malloc_peak_dump(stderr, true);
+
+    // freed blocks are not in the next snapshot
+    malloc_peak_reset();
+    void *p3 = realloc(malloc(100), 600000);
+    ASSERT_TRUE(malloc_peak_snapshot(&snapshot));
+    size = 0;
+    for (int i = 0; i < snapshot.n_sites; i++) {
+        if (snapshot.sites[i].size >= 200000) size += snapshot.sites[i].size;
+    }
+    ASSERT_EQ(size, 600000);
+    free(p3);
+
+    malloc_peak_snapshot_threshold(-1);
+    malloc_peak_reset();
+    ASSERT_FALSE(malloc_peak_snapshot(&snapshot));
+}
+
+TEST(MallocHookTest, remote_free) {
+    _hookSetUp.clear();
+    malloc_remote_free_reset();
+
+    void *p = NULL;
+    int alloc_tid = 0;
+    std::thread th([&p, &alloc_tid] {
+        alloc_tid = gettid();
+        p = malloc(12345);
+    });
+    th.join();
+
+    // failed realloc does not free the block
+    volatile size_t huge = SIZE_MAX / 2;
+    ASSERT_EQ(realloc(p, huge), nullptr);
+    free(p);
+
+    malloc_remote_free_stat_t stats[16];
+    int n = malloc_remote_free_stats(stats, 16);
+    bool found = false;
+    for (int i = 0; i < n; i++) {
+        if (stats[i].alloc_tid == alloc_tid && stats[i].free_tid == gettid() && stats[i].size == 12345) {
+            ASSERT_EQ(stats[i].count, 1);
+            found = true;
+        }
+    }
+    ASSERT_TRUE(found);
+
+    malloc_remote_free_dump(stderr, true);
+    malloc_remote_free_reset();
+}
+
+static int filter_malloc_count;
+
+static void filter_malloc_hook(void *, size_t, void *[]) {
+    filter_malloc_count++;
+}
+
+TEST(MallocHookTest, filter_module) {
+    _hookSetUp.clear();
+    ASSERT_EQ(malloc_hook_filter_add_module("no_such_module.so"), -1);
+    ASSERT_EQ(malloc_hook_filter_add_module(NULL), 0); // main program
+    set_malloc_hook(filter_malloc_hook);
+
+    filter_malloc_count = 0;
+    void *p = malloc(100);  // called from main program
+    char *s = strdup("test");  // called from libc
+    set_malloc_hook(NULL);
+    malloc_hook_filter_reset();
+
+    ASSERT_EQ(filter_malloc_count, 1);
+    free(s);
+    free(p);
+}
+
+TEST(MallocHookTest, thread_id_after_fork) {
+    _hookSetUp.clear();
+    free(malloc(1));  // cache thread id of parent
+
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0) {
+        FILE *fp = tmpfile();
+        malloc_heap_dump_mark();
+        void *p = malloc(100);
+        malloc_heap_dump(fp, false);
+        malloc_heap_dump_unmark();
+        free(p);
+
+        char line[1024];
+        char expected[32];
+        snprintf(expected, sizeof(expected), "tid=%d ", (int)getpid());
+        int found = 0;
+        rewind(fp);
+        while (fgets(line, sizeof(line), fp)) {
+            if (strstr(line, expected)) found++;
+        }
+        _exit(found > 0 ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+}
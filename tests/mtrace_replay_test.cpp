@@ -0,0 +1,56 @@
+#include <gtest/gtest.h>
+#include <sstream>
+
+#include "../tools/mtrace_trace.hpp"
+
+using namespace mtrace_replay;
+
+static const char *TRACE_LOG =
+    "= Start\n"
+    "@ ./a.out:[0x401000] + 0x1000 0x10 t=100\n"
+    "@ ./a.out:[0x401000] < (nil) t=100\n"            // realloc(NULL) -> malloc
+    "@ ./a.out:[0x401000] > 0x2000 0x20 t=100\n"
+    "@ ./a.out:[0x401000] < 0x1000 t=100 (main+0x10)\n"  // realloc
+    "@ ./a.out:[0x401000] > 0x3000 0x30 t=100 (main+0x10)\n"
+    "@ ./a.out:[0x401000] - 0x9000 t=100\n"           // unknown pointer, ignored
+    "@ ./a.out:[0x401000] - 0x2000 t=200\n"           // freed by other thread
+    "@ ./a.out:[0x401000] - 0x3000 t=100\n"
+    "= End\n";
+
+TEST(MtraceReplayTest, parse) {
+    std::istringstream in(TRACE_LOG);
+    Trace trace;
+    parseTrace(in, false, trace);
+
+    ASSERT_EQ(trace.mallocCount, 2);
+    ASSERT_EQ(trace.reallocCount, 1);
+    ASSERT_EQ(trace.freeCount, 2);
+    ASSERT_EQ(trace.slotCount, 3u);
+    ASSERT_EQ(trace.streams.size(), 1u);
+
+    const std::vector<Op> &ops = trace.streams[0].ops;
+    ASSERT_EQ(ops.size(), 5u);
+    ASSERT_EQ(ops[1].type, OP_MALLOC);  // realloc(NULL)
+    ASSERT_EQ(ops[1].size, 0x20u);
+    ASSERT_EQ(ops[2].type, OP_REALLOC);
+    ASSERT_EQ(ops[2].oldSlot, ops[0].slot);
+    ASSERT_EQ(ops[2].size, 0x30u);
+    ASSERT_EQ(ops[3].type, OP_FREE);
+    ASSERT_EQ(ops[3].slot, ops[1].slot);
+    ASSERT_EQ(ops[4].type, OP_FREE);
+    ASSERT_EQ(ops[4].slot, ops[2].slot);
+}
+
+TEST(MtraceReplayTest, parse_per_thread) {
+    std::istringstream in(TRACE_LOG);
+    Trace trace;
+    parseTrace(in, true, trace);
+
+    ASSERT_EQ(trace.streams.size(), 2u);
+    ASSERT_EQ(trace.streams[0].tid, 100);
+    ASSERT_EQ(trace.streams[0].ops.size(), 4u);
+    ASSERT_EQ(trace.streams[1].tid, 200);
+    ASSERT_EQ(trace.streams[1].ops.size(), 1u);
+    ASSERT_EQ(trace.streams[1].ops[0].type, OP_FREE);
+    ASSERT_EQ(trace.streams[1].ops[0].slot, trace.streams[0].ops[1].slot);
+}
@@ -1,5 +1,9 @@
 #include <gtest/gtest.h>
 #include <dlfcn.h>
+#include <unistd.h>
+#include <mutex>
+#include <string>
+#include <thread>
 
 #include "../malloc_hook.h"
 
@@ -17,3 +21,144 @@ TEST(MtraceTest, trace) {
 
     malloc_hook_muntrace();
 }
+
+TEST(MtraceTest, thread_id) {
+    FILE *fp = tmpfile();
+    malloc_hook_mtrace_thread_id(true);
+    malloc_hook_mtrace_fp("./malloc_hook_test", fp, false, 1);
+
+    void *p = malloc(100);
+    free(p);
+
+    malloc_hook_muntrace();
+    malloc_hook_mtrace_thread_id(false);
+
+    char line[1024];
+    char expected[32];
+    snprintf(expected, sizeof(expected), " t=%ld", (long)gettid());
+    rewind(fp);
+    int found = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '@' && strstr(line, expected)) found++;
+    }
+    fclose(fp);
+    ASSERT_GE(found, 2);
+}
+
+TEST(MtraceTest, tag) {
+    FILE *fp = tmpfile();
+    malloc_hook_mtrace_tag(5);
+    malloc_hook_mtrace_fp("./malloc_hook_test", fp, false, 1);
+
+    void *p1 = malloc(0x111);
+    malloc_hook_push_tag(5);
+    void *p2 = malloc(0x222);
+    malloc_hook_pop_tag();
+    free(p1);
+    free(p2);
+
+    malloc_hook_muntrace();
+    malloc_hook_mtrace_tag(-1);
+
+    char line[1024];
+    int lines = 0;
+    rewind(fp);
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] != '@') continue;
+        lines++;
+        ASSERT_EQ(strstr(line, "0x111"), nullptr);
+    }
+    fclose(fp);
+    ASSERT_EQ(lines, 2); // malloc and free of p2
+}
+
+// operation types ("+", "-", "<", ">") of mtrace lines
+static std::string read_mtrace_ops(FILE *fp) {
+    char line[1024];
+    std::string ops;
+    rewind(fp);
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] != '@') continue;
+        char *p = strstr(line, "] ");
+        if (p) ops += p[2];
+    }
+    fclose(fp);
+    return ops;
+}
+
+TEST(MtraceTest, filter) {
+    FILE *fp = tmpfile();
+    malloc_hook_filter_add_size(0x10000, (size_t)-1);
+    malloc_hook_filter_ops(MALLOC_FILTER_MALLOC | MALLOC_FILTER_FREE);
+    malloc_hook_mtrace_fp("./malloc_hook_test", fp, false, 1);
+
+    long initial = get_malloc_total();
+    void *p1 = malloc(0x100);
+    void *p2 = malloc(0x20000);
+    p2 = realloc(p2, 0x30000);
+    ASSERT_EQ(get_malloc_total(), initial + 0x100 + 0x30000);  // filtered out blocks are tracked too
+    free(p1);
+    free(p2);
+
+    malloc_hook_muntrace();
+    malloc_hook_filter_reset();
+
+    // realloc is excluded by operation type filter
+    ASSERT_EQ(read_mtrace_ops(fp), "+-");
+}
+
+TEST(MtraceTest, filter_realloc_shrink) {
+    FILE *fp = tmpfile();
+    malloc_hook_filter_add_size(0x10000, (size_t)-1);
+    malloc_hook_mtrace_fp("./malloc_hook_test", fp, false, 1);
+
+    void *p = malloc(0x20000);
+    p = realloc(p, 0x10);
+    free(p);
+
+    malloc_hook_muntrace();
+    malloc_hook_filter_reset();
+
+    ASSERT_EQ(read_mtrace_ops(fp), "+<>-");
+}
+
+TEST(MtraceTest, filter_realloc_grow) {
+    FILE *fp = tmpfile();
+    malloc_hook_filter_add_size(0x10000, (size_t)-1);
+    malloc_hook_mtrace_fp("./malloc_hook_test", fp, false, 1);
+
+    void *p = malloc(0x10);
+    p = realloc(p, 0x20000);
+    free(p);
+
+    malloc_hook_muntrace();
+    malloc_hook_filter_reset();
+
+    ASSERT_EQ(read_mtrace_ops(fp), "<>-");
+}
+
+TEST(MtraceTest, filter_thread_remote_free) {
+    FILE *fp = tmpfile();
+    void *p = NULL;
+    int tid = 0;
+    std::mutex m;
+    m.lock();
+    std::thread th([&] {
+        __atomic_store_n(&tid, (int)gettid(), __ATOMIC_RELEASE);
+        m.lock();  // wait for filter setup
+        p = malloc(0x30);
+        m.unlock();
+    });
+    while (__atomic_load_n(&tid, __ATOMIC_ACQUIRE) == 0) std::this_thread::yield();
+    malloc_hook_filter_add_thread(tid);
+    malloc_hook_filter_add_size(0x30, 0x30);
+    malloc_hook_mtrace_fp("./malloc_hook_test", fp, false, 1);
+    m.unlock();
+    th.join();
+    free(p);  // freed on other thread
+
+    malloc_hook_muntrace();
+    malloc_hook_filter_reset();
+
+    ASSERT_EQ(read_mtrace_ops(fp), "+-");
+}
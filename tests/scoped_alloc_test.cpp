@@ -0,0 +1,136 @@
+#include <gtest/gtest.h>
+#include <thread>
+
+#include "../malloc_hook.hpp"
+
+using malloc_hook::ScopedAllocCounter;
+using malloc_hook::ScopedNoAlloc;
+
+TEST(ScopedAllocTest, counter) {
+    ScopedAllocCounter counter;
+
+    void *p = malloc(100);
+    p = realloc(p, 200);
+    free(p);
+    counter.stop();
+
+    ASSERT_EQ(counter.allocCount(), 2);
+    ASSERT_EQ(counter.allocBytes(), 300);
+    ASSERT_EQ(counter.freeCount(), 2);
+    ASSERT_EQ(counter.freeBytes(), 300);
+
+    fprintf(stderr, "%s", counter.report().c_str());
+}
+
+TEST(ScopedAllocTest, nested) {
+    ScopedAllocCounter outer;
+    void *p1 = malloc(10);
+    {
+        ScopedAllocCounter inner;
+        void *p2 = malloc(20);
+        free(p2);
+        inner.stop();
+        ASSERT_EQ(inner.allocCount(), 1);
+        ASSERT_EQ(inner.allocBytes(), 20);
+    }
+    free(p1);
+    outer.stop();
+
+    ASSERT_EQ(outer.allocCount(), 2);
+    ASSERT_EQ(outer.allocBytes(), 30);
+    ASSERT_NE(outer.report(false).find("size=10"), std::string::npos);
+}
+
+TEST(ScopedAllocTest, other_thread) {
+    long thread_alloc_bytes = 0;
+
+    ScopedAllocCounter counter;
+    std::thread th([&thread_alloc_bytes] {
+        ScopedAllocCounter thread_counter;
+        void *p = malloc(100000);
+        free(p);
+        thread_counter.stop();
+        thread_alloc_bytes = thread_counter.allocBytes();
+    });
+    th.join();
+    counter.stop();
+
+    // thread creation allocates on this thread, but allocations in the thread are not counted.
+    ASSERT_LT(counter.allocBytes(), 100000);
+    ASSERT_EQ(thread_alloc_bytes, 100000);
+}
+
+TEST(ScopedAllocTest, no_alloc) {
+    int sum = 0;
+    ASSERT_NO_ALLOC(for (int i = 0; i < 100; i++) sum += i);
+    ASSERT_EQ(sum, 4950);
+
+    ScopedNoAlloc guard;
+    void *p = malloc(1);
+    guard.stop();
+    free(p);
+    ASSERT_FALSE(guard.ok());
+    fprintf(stderr, "%s", guard.report().c_str());
+}
+
+TEST(ScopedAllocTest, tag) {
+    const int TAG = 10;
+    malloc_tag_stat_t initial;
+    malloc_tag_stats(TAG, &initial);
+
+    void *p1, *p2, *p3;
+    {
+        malloc_hook::ScopedTag tag(TAG);
+        ASSERT_EQ(malloc_hook_current_tag(), TAG);
+        p1 = malloc(100);
+        {
+            malloc_hook::ScopedTag inner(TAG + 1);
+            p2 = malloc(200);
+        }
+        p3 = malloc(300);
+    }
+    ASSERT_EQ(malloc_hook_current_tag(), 0);
+    ASSERT_EQ(malloc_hook_get_tag(p1), TAG);
+    ASSERT_EQ(malloc_hook_get_tag(p2), TAG + 1);
+
+    // realloc keeps the tag
+    p3 = realloc(p3, 3000);
+    ASSERT_EQ(malloc_hook_get_tag(p3), TAG);
+
+    malloc_tag_stat_t stat;
+    malloc_tag_stats(TAG, &stat);
+    ASSERT_EQ(stat.size, initial.size + 3100);
+    ASSERT_EQ(stat.count, initial.count + 2);
+    ASSERT_GE(stat.peak, initial.size + 3100);
+
+    malloc_hook_set_tag_name(TAG, "test");
+    malloc_tag_dump(stderr);
+    malloc_heap_dump_tag(stderr, false, TAG);
+
+    free(p1);
+    free(p2);
+    free(p3);
+    malloc_tag_stats(TAG, &stat);
+    ASSERT_EQ(stat.size, initial.size);
+    ASSERT_EQ(stat.count, initial.count);
+}
+
+static void scope_malloc_hook(void *, size_t, void *[]) {
+    ScopedAllocCounter counter;
+}
+
+TEST(ScopedAllocTest, scope_in_hook) {
+    set_malloc_hook(scope_malloc_hook);
+    void *p = malloc(10);
+    set_malloc_hook(NULL);
+    free(p);
+
+    // no scope is active: counters must not change
+    malloc_thread_stats_t before, after;
+    malloc_thread_stats(&before);
+    p = malloc(10);
+    free(p);
+    malloc_thread_stats(&after);
+    ASSERT_EQ(after.alloc_count, before.alloc_count);
+    ASSERT_EQ(after.free_count, before.free_count);
+}
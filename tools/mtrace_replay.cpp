@@ -0,0 +1,314 @@
+/*
+ * Memory Hook library for debugging
+ * https://github.com/tmurakam/malloc_hook
+ *
+ * Copyright (c) 2022, Takuya Murakami.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * mtrace replay tool
+ *
+ * Replay malloc/realloc/free operations recorded by malloc_hook_mtrace(), and
+ * report wall time, ns/op percentiles and peak RSS.
+ * The trace is replayed twice: wall time and RSS are measured in the first pass without
+ * per-op timing, and ns/op in the second pass.
+ * This is not linked with malloc_hook, so the allocator under test is glibc malloc
+ * or any allocator loaded with LD_PRELOAD.
+ *
+ * Usage: mtrace_replay [-t] [-m] mtrace.log
+ *   -t : Replay per-thread streams in separate threads (needs malloc_hook_mtrace_thread_id(true))
+ *   -m : Touch (memset) allocated memory
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "mtrace_trace.hpp"
+
+using namespace mtrace_replay;
+
+namespace {
+
+/**
+ * Latency histogram: 1ns resolution below LINEAR_MAX, power of two buckets above.
+ * Percentiles in power of two buckets are reported as the upper bound of the bucket.
+ */
+class Histogram {
+public:
+    static const int LINEAR_MAX = 4096;
+    static const int LOG_BUCKETS = 64;
+
+    Histogram() : linear_(LINEAR_MAX), log_(LOG_BUCKETS) {}
+
+    void add(uint64_t ns) {
+        if (ns < LINEAR_MAX) {
+            linear_[ns]++;
+        } else {
+            log_[63 - __builtin_clzll(ns)]++;
+        }
+        count_++;
+        if (ns > max_) max_ = ns;
+    }
+
+    void merge(const Histogram &other) {
+        for (int i = 0; i < LINEAR_MAX; i++) linear_[i] += other.linear_[i];
+        for (int i = 0; i < LOG_BUCKETS; i++) log_[i] += other.log_[i];
+        count_ += other.count_;
+        if (other.max_ > max_) max_ = other.max_;
+    }
+
+    uint64_t percentile(double p) const {
+        uint64_t target = (uint64_t)(count_ * p / 100.0);
+        uint64_t n = 0;
+        for (int i = 0; i < LINEAR_MAX; i++) {
+            n += linear_[i];
+            if (n > target) return i;
+        }
+        for (int i = 0; i < LOG_BUCKETS; i++) {
+            n += log_[i];
+            if (n > target) {
+                // upper bound of the bucket [2^i, 2^(i+1))
+                uint64_t upper = (2ULL << i) - 1;
+                return upper < max_ ? upper : max_;
+            }
+        }
+        return max_;
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t max() const { return max_; }
+
+private:
+    std::vector<uint64_t> linear_;
+    std::vector<uint64_t> log_;
+    uint64_t count_ = 0;
+    uint64_t max_ = 0;
+};
+
+/**
+ * Replay one stream.
+ * In multi thread mode, a block may be freed by other thread than the allocating thread.
+ * Wait until the block is allocated in that case. The trace order guarantees no dead lock.
+ * If Timed, each op is timed and added to hist, excluding clockOverhead.
+ */
+template <bool Timed>
+void replayStream(const Stream &stream, std::vector<std::atomic<void *>> &slots, bool touch,
+                  uint64_t clockOverhead, Histogram *hist) {
+    for (const Op &op : stream.ops) {
+        void *old = nullptr;
+        if (op.type != OP_MALLOC) {
+            uint32_t waitSlot = op.type == OP_FREE ? op.slot : op.oldSlot;
+            while ((old = slots[waitSlot].load(std::memory_order_acquire)) == nullptr) {
+                std::this_thread::yield();
+            }
+            slots[waitSlot].store(nullptr, std::memory_order_relaxed);  // consumed
+        }
+
+        std::chrono::steady_clock::time_point start;
+        if (Timed) start = std::chrono::steady_clock::now();
+        void *p = nullptr;
+        switch (op.type) {
+            case OP_MALLOC:
+                p = malloc(op.size);
+                break;
+            case OP_REALLOC:
+                p = realloc(old, op.size);
+                break;
+            case OP_FREE:
+                free(old);
+                break;
+        }
+        if (Timed) {
+            auto end = std::chrono::steady_clock::now();
+            uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+            hist->add(ns > clockOverhead ? ns - clockOverhead : 0);
+        }
+
+        if (op.type != OP_FREE) {
+            size_t touchSize = op.size;
+            if (p == nullptr) {
+                // keep slot non-null to avoid waiting forever, free(dummy) is harmless
+                p = malloc(1);
+                touchSize = 0;
+            }
+            if (touch && p != nullptr) {
+                memset(p, 0, touchSize);
+            }
+            slots[op.slot].store(p, std::memory_order_release);
+        }
+    }
+}
+
+/**
+ * Replay all streams, and free blocks left allocated at the end of the trace.
+ */
+template <bool Timed>
+void replay(const Trace &trace, bool perThread, std::vector<std::atomic<void *>> &slots, bool touch,
+            uint64_t clockOverhead, std::vector<Histogram> &hists) {
+    if (perThread) {
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < trace.streams.size(); i++) {
+            threads.emplace_back([&, i] {
+                replayStream<Timed>(trace.streams[i], slots, touch, clockOverhead, &hists[i]);
+            });
+        }
+        for (auto &th : threads) {
+            th.join();
+        }
+    } else if (!trace.streams.empty()) {
+        replayStream<Timed>(trace.streams[0], slots, touch, clockOverhead, &hists[0]);
+    }
+}
+
+void freeSlots(std::vector<std::atomic<void *>> &slots) {
+    for (auto &slot : slots) {
+        free(slot.exchange(nullptr, std::memory_order_relaxed));
+    }
+}
+
+/**
+ * Overhead of a pair of steady_clock::now() calls (median)
+ */
+uint64_t calibrateClock() {
+    const int N = 1001;
+    std::vector<uint64_t> samples(N);
+    for (int i = 0; i < N; i++) {
+        auto start = std::chrono::steady_clock::now();
+        auto end = std::chrono::steady_clock::now();
+        samples[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    }
+    std::nth_element(samples.begin(), samples.begin() + N / 2, samples.end());
+    return samples[N / 2];
+}
+
+/**
+ * Read value (kB) from /proc/self/status
+ */
+long readProcStatus(const char *key) {
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (!fp) return -1;
+    char line[256];
+    long value = -1;
+    size_t len = strlen(key);
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, key, len) == 0 && line[len] == ':') {
+            value = strtol(line + len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(fp);
+    return value;
+}
+
+/**
+ * Reset peak RSS (VmHWM), available on Linux 4.0 or later.
+ */
+void resetPeakRss() {
+    FILE *fp = fopen("/proc/self/clear_refs", "w");
+    if (fp) {
+        fputs("5", fp);
+        fclose(fp);
+    }
+}
+
+void usage() {
+    fprintf(stderr, "Usage: mtrace_replay [-t] [-m] mtrace.log\n");
+    fprintf(stderr, "  -t : Replay per-thread streams in separate threads\n");
+    fprintf(stderr, "  -m : Touch (memset) allocated memory\n");
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    bool perThread = false;
+    bool touch = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "tm")) != -1) {
+        switch (opt) {
+            case 't':
+                perThread = true;
+                break;
+            case 'm':
+                touch = true;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage();
+        return 1;
+    }
+    const char *filename = argv[optind];
+
+    Trace trace;
+    if (!parseTrace(filename, perThread, trace)) {
+        return 1;
+    }
+
+    std::vector<std::atomic<void *>> slots(trace.slotCount);
+    for (auto &slot : slots) {
+        slot.store(nullptr, std::memory_order_relaxed);
+    }
+    std::vector<Histogram> hists(trace.streams.size());
+
+    uint64_t clockOverhead = calibrateClock();
+
+    // pass 1: wall time and RSS, without per-op timing
+    resetPeakRss();
+    long rssBefore = readProcStatus("VmRSS");
+    auto start = std::chrono::steady_clock::now();
+    replay<false>(trace, perThread, slots, touch, 0, hists);
+    auto end = std::chrono::steady_clock::now();
+    long rssPeak = readProcStatus("VmHWM");
+    freeSlots(slots);
+
+    // pass 2: ns/op
+    replay<true>(trace, perThread, slots, touch, clockOverhead, hists);
+    freeSlots(slots);
+
+    Histogram total;
+    for (const auto &hist : hists) {
+        total.merge(hist);
+    }
+    double wallMs = std::chrono::duration<double, std::milli>(end - start).count();
+
+    printf("trace: %s\n", filename);
+    printf("threads: %zu, ops: %lu (malloc=%ld, realloc=%ld, free=%ld)\n",
+           perThread ? trace.streams.size() : (size_t)1, (unsigned long)total.count(),
+           trace.mallocCount, trace.reallocCount, trace.freeCount);
+    printf("wall time: %.3f ms\n", wallMs);
+    printf("ns/op: p50=%lu, p90=%lu, p99=%lu, p99.9=%lu, max=%lu (clock overhead %lu ns excluded)\n",
+           (unsigned long)total.percentile(50), (unsigned long)total.percentile(90),
+           (unsigned long)total.percentile(99), (unsigned long)total.percentile(99.9),
+           (unsigned long)total.max(), (unsigned long)clockOverhead);
+    printf("rss: before=%ld kB, peak=%ld kB, delta=%ld kB\n", rssBefore, rssPeak, rssPeak - rssBefore);
+    return 0;
+}
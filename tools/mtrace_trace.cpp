@@ -0,0 +1,134 @@
+/*
+ * Memory Hook library for debugging
+ * https://github.com/tmurakam/malloc_hook
+ *
+ * Copyright (c) 2022, Takuya Murakami.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+#include "mtrace_trace.hpp"
+
+namespace mtrace_replay {
+
+void parseTrace(std::istream &in, bool perThread, Trace &trace) {
+    std::unordered_map<uintptr_t, uint32_t> ptrToSlot;
+    std::map<long, size_t> tidToStream;
+    std::unordered_map<long, uint32_t> pendingRealloc; // tid -> old slot of '<' line
+
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.compare(0, 2, "@ ") != 0) continue;
+
+        std::istringstream ss(line);
+        std::string at, location, type, ptrStr, tok;
+        ss >> at >> location >> type >> ptrStr;
+        if (type.size() != 1) continue;
+
+        uint64_t size = 0;
+        long tid = 0;
+        while (ss >> tok) {
+            if (tok[0] == '(') break;
+            if (tok.compare(0, 2, "0x") == 0) {
+                size = strtoull(tok.c_str(), NULL, 16);
+            } else if (tok.compare(0, 2, "t=") == 0) {
+                tid = strtol(tok.c_str() + 2, NULL, 10);
+            }
+        }
+        uintptr_t ptr = strtoull(ptrStr.c_str(), NULL, 16); // "(nil)" -> 0
+
+        if (!perThread) tid = 0;
+        auto it = tidToStream.find(tid);
+        if (it == tidToStream.end()) {
+            it = tidToStream.emplace(tid, trace.streams.size()).first;
+            trace.streams.push_back(Stream{tid, {}});
+        }
+        std::vector<Op> &ops = trace.streams[it->second].ops;
+
+        // find and forget slot of the pointer, returns NO_SLOT if unknown (allocated before trace start)
+        auto takeSlot = [&ptrToSlot](uintptr_t p) {
+            auto s = ptrToSlot.find(p);
+            if (s == ptrToSlot.end()) return NO_SLOT;
+            uint32_t slot = s->second;
+            ptrToSlot.erase(s);
+            return slot;
+        };
+
+        switch (type[0]) {
+            case '+': {
+                uint32_t slot = trace.slotCount++;
+                ptrToSlot[ptr] = slot;
+                ops.push_back(Op{size, slot, NO_SLOT, OP_MALLOC});
+                trace.mallocCount++;
+                break;
+            }
+            case '-': {
+                uint32_t slot = takeSlot(ptr);
+                if (slot != NO_SLOT) {
+                    ops.push_back(Op{0, slot, NO_SLOT, OP_FREE});
+                    trace.freeCount++;
+                }
+                break;
+            }
+            case '<':
+                pendingRealloc[tid] = ptr ? takeSlot(ptr) : NO_SLOT;
+                break;
+            case '>': {
+                uint32_t oldSlot = NO_SLOT;
+                auto p = pendingRealloc.find(tid);
+                if (p != pendingRealloc.end()) {
+                    oldSlot = p->second;
+                    pendingRealloc.erase(p);
+                }
+                uint32_t slot = trace.slotCount++;
+                ptrToSlot[ptr] = slot;
+                if (oldSlot != NO_SLOT) {
+                    ops.push_back(Op{size, slot, oldSlot, OP_REALLOC});
+                    trace.reallocCount++;
+                } else {
+                    ops.push_back(Op{size, slot, NO_SLOT, OP_MALLOC});
+                    trace.mallocCount++;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+bool parseTrace(const char *filename, bool perThread, Trace &trace) {
+    std::ifstream in(filename);
+    if (!in) {
+        fprintf(stderr, "Can't open %s\n", filename);
+        return false;
+    }
+    parseTrace(in, perThread, trace);
+    return true;
+}
+
+} // namespace mtrace_replay
@@ -0,0 +1,83 @@
+/*
+ * Memory Hook library for debugging
+ * https://github.com/tmurakam/malloc_hook
+ *
+ * Copyright (c) 2022, Takuya Murakami.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <vector>
+
+namespace mtrace_replay {
+
+enum OpType : uint8_t {
+    OP_MALLOC,
+    OP_REALLOC,
+    OP_FREE,
+};
+
+const uint32_t NO_SLOT = UINT32_MAX;
+
+/**
+ * Compact operation. Pointers in the trace are replaced with slot indexes.
+ */
+struct Op {
+    uint64_t size;
+    uint32_t slot;      // slot of the result (malloc, realloc) or the block to free (free)
+    uint32_t oldSlot;   // slot of the old block (realloc)
+    OpType type;
+};
+
+struct Stream {
+    long tid;
+    std::vector<Op> ops;
+};
+
+struct Trace {
+    std::vector<Stream> streams;
+    uint32_t slotCount = 0;
+    long mallocCount = 0;
+    long reallocCount = 0;
+    long freeCount = 0;
+};
+
+/**
+ * Parse mtrace log
+ * Line format: "@ program:[caller] <type> <ptr> [0x<size>] [t=<tid>] [(symbols)]"
+ *
+ * Frees of unknown pointers (allocated before trace start) are ignored.
+ *
+ * @param in  Input stream of mtrace log
+ * @param perThread  Set true to split operations into per-thread streams with "t=" field
+ * @param trace  Output trace
+ */
+void parseTrace(std::istream &in, bool perThread, Trace &trace);
+
+/**
+ * Parse mtrace log file
+ * @return false if the file can't be opened
+ */
+bool parseTrace(const char *filename, bool perThread, Trace &trace);
+
+} // namespace mtrace_replay